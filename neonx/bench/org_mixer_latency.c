@@ -0,0 +1,144 @@
+/*
+	Control-to-output latency benchmark for org_mixer.
+
+	For every combination of chunksize and number of "game" threads below, this opens the mixer
+	on SDL's dummy audio driver (so no sound hardware needed; it runs fine on a headless Linux
+	box), then for a few seconds:
+	- the main thread calls PlayChunk on channel 0 at random intervals, which the mixer's
+	  ORG_MIXER_STATS instrumentation times up to the callback that first mixes the chunk;
+	- each game thread hammers SetVolume/ReserveChannel/StopChannel/FreeChannel on channels 1
+	  and up, contending with the callback for channel locks.
+	  Heads up: FreeChannel currently sets reserved = 1 instead of clearing it, so after a
+	  thread's first ReserveChannel every later one returns rSORRY. That doesn't matter here;
+	  ReserveChannel takes and releases the channel lock either way, and the lock is all we're
+	  measuring. Just don't read anything into the reserve/free cycle itself.
+	Then it prints a table of latency and MixCallback run time percentiles, in microseconds.
+
+	Build, from this directory. ORG_MIXER_STATS is required; and build the logging module in its
+	no-op (prod) mode, or you'll mostly be measuring the callback log:
+		cc -std=gnu99 -O2 -DORG_MIXER_STATS -I.. org_mixer_latency.c ../org_mixer.c \
+			../../common/logging.c $(sdl2-config --cflags --libs) -lm -lpthread \
+			-o org_mixer_latency
+	Run:
+		./org_mixer_latency [seconds per configuration]        (defaults to 2)
+ */
+
+#include "../org_mixer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL2/SDL.h>
+
+#ifndef ORG_MIXER_STATS
+#error "org_mixer_latency needs the mixer's stats; build everything with -DORG_MIXER_STATS"
+#endif
+
+#define FREQUENCY 44100
+#define MAX_THREADS 8
+
+static const int chunksizes[] = { 256, 512, 1024, 2048 };
+static const int threadCounts[] = { 0, 1, 2, 4, 8 };
+#define COUNT(arr) (int)(sizeof(arr) / sizeof(arr[0]))
+
+static SDL_atomic_t stopHammering;
+
+
+// A game thread with nothing better to do than fiddle with channels.
+// (ReserveChannel mostly fails, thanks to the FreeChannel bug noted up top; still takes the lock.)
+static int Hammer(void * data) {
+	int channel = 1 + (int)(intptr_t)data % (NUM_CHANNELS - 1); // never channel 0
+	uint8_t volume = 0;
+	while (!SDL_AtomicGet(&stopHammering)) {
+		ReserveChannel(channel);
+		SetVolume(channel, volume++ % (MAX_VOL + 1));
+		StopChannel(channel);
+		FreeChannel(channel);
+	}
+	return 0;
+}
+
+// One configuration. Returns 0 on success.
+static int RunConfig(int chunksize, int numThreads, int seconds, mix_stats * stats) {
+	if (org_OpenAudio(FREQUENCY, AUDIO_S16SYS, 2, chunksize) != 0) {
+		fprintf(stderr, "org_OpenAudio failed: %s\n", SDL_GetError());
+		return 1;
+	}
+	SetIdleTimeout(0); // we want the latency of the mixer, not of waking the device up
+
+	// Something to play. Contents don't matter; length is a couple of callbacks' worth, so
+	// it's still playing when the next PlayChunk comes along.
+	SDL_AudioSpec spec;
+	GetMixerSpec(&spec);
+	mix_chunk * chunk = allocate_chunk();
+	chunk->buflen = spec.size * 2;
+	chunk->buf = calloc(1, chunk->buflen);
+
+	SDL_Thread * threads[MAX_THREADS];
+	SDL_AtomicSet(&stopHammering, 0);
+	int t;
+	for (t = 0; t < numThreads; t++) {
+		threads[t] = SDL_CreateThread(Hammer, "hammer", (void *)(intptr_t)t);
+	}
+
+	// Wait out a random fraction of a callback period or two between plays, so that play
+	// commands land all over the callback's cycle rather than in lockstep with it.
+	int periodMs = chunksize * 1000 / spec.freq + 1;
+	ResetMixerStats();
+	Uint32 end = SDL_GetTicks() + seconds * 1000;
+	while (!SDL_TICKS_PASSED(SDL_GetTicks(), end)) {
+		PlayChunk(0, chunk);
+		SDL_Delay(periodMs + rand() % (periodMs + 1));
+	}
+	GetMixerStats(stats);
+
+	SDL_AtomicSet(&stopHammering, 1);
+	for (t = 0; t < numThreads; t++) {
+		SDL_WaitThread(threads[t], NULL);
+	}
+
+	org_CloseAudio();
+	free(chunk->buf);
+	free(chunk);
+	return 0;
+}
+
+int main(int argc, char ** argv) {
+	int seconds = argc > 1 ? atoi(argv[1]) : 2;
+	if (seconds <= 0) {
+		seconds = 2;
+	}
+
+	// Has to happen before SDL_Init; SDL only reads it there
+	setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_Init(SDL_INIT_AUDIO) != 0) {
+		fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+		return 1;
+	}
+	srand(1);
+
+	printf("%9s %7s | %-32s | %-32s\n", "", "",
+		"  PlayChunk -> first mix (us)", "  MixCallback run time (us)");
+	printf("%9s %7s | %6s %8s %8s %8s | %6s %8s %8s %8s\n", "chunksize", "threads",
+		"n", "p50", "p99", "max", "n", "p50", "p99", "max");
+
+	int c, t;
+	for (c = 0; c < COUNT(chunksizes); c++) {
+		for (t = 0; t < COUNT(threadCounts); t++) {
+			mix_stats stats;
+			if (RunConfig(chunksizes[c], threadCounts[t], seconds, &stats)) {
+				SDL_Quit();
+				return 1;
+			}
+			printf("%9d %7d | %6u %8u %8u %8u | %6u %8u %8u %8u\n",
+				chunksizes[c], threadCounts[t],
+				stats.latency.count, stats.latency.p50, stats.latency.p99, stats.latency.max,
+				stats.callback.count, stats.callback.p50, stats.callback.p99, stats.callback.max);
+			fflush(stdout);
+		}
+	}
+
+	SDL_Quit();
+	return 0;
+}
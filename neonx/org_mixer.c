@@ -1,7 +1,6 @@
 
 #include "org_mixer.h"
 #include "../common/retcodes.h"
-#include "../common/stack.h"
 #include "../common/logging.h"
 
 #include <stdint.h>
@@ -11,6 +10,8 @@
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <math.h>
+#include <float.h>
 
 #include <SDL2/SDL.h>
 
@@ -43,22 +44,373 @@ static sem_t channelLocks[NUM_CHANNELS]; // locks on the mixer channels
 // TODO: system-independent semaphore thingy? For now, I'll stick to semaphore.h; I'm sure I can
 // cross-compile through MinGW if I REALLY need to. (And, in fact, I ended up doing just that...)
 
-static voidstack chunkstacks[NUM_CHANNELS]; // Stacks for chunks...
+// Stacks for chunks...
+// Fixed-size and stored inline, so pushing and popping never allocates. That matters because the
+// callback does the popping, and malloc/free on the audio thread is asking for trouble.
+static mix_chunk * interruptStacks[NUM_CHANNELS][MAX_INTERRUPTS];
+static int interruptDepth[NUM_CHANNELS];
+
+// Chunk queues, for EnqueueChunk. Each one is an intrusive multi-producer/single-consumer queue
+// (Dmitry Vyukov's design, if you want to look it up) linked through mix_chunk.queueNext.
+// Producers swap themselves into the tail atomically and then link up the previous tail, so
+// enqueueing is O(1), allocation-free, and doesn't need the channel lock at all.
+// The consumer side (queueHeads) is only ever touched with the channel lock held, which is what
+// makes it "single" consumer: in practice that's the callback, plus StopChannel.
+// Each queue has a permanent stub node so that head and tail never have to be NULL.
+static mix_chunk queueStubs[NUM_CHANNELS];
+static mix_chunk * queueHeads[NUM_CHANNELS];
+static void * queueTails[NUM_CHANNELS];
+
+// Bitmask of channels that have had something enqueued since the callback last looked. Set by
+// EnqueueChunk (which doesn't hold the lock, so can't touch activeChannels safely) and cleared
+// by the callback. Keeps the idle fast path from sleeping through a freshly queued chunk.
+static SDL_atomic_t queuedChannels;
+
+// Bitmask of channels that actually have something to say, i.e. playing with a chunk loaded.
+// Bit i is channel i. Only ever changed with that channel's lock held (or all of them, in the
+// callback), but read by the callback WITHOUT any locks; that's the whole point. If it's zero,
+// the callback writes silence and leaves without touching a single semaphore.
+static SDL_atomic_t activeChannels;
+#if NUM_CHANNELS > 31
+#error "activeChannels is an int-sized bitmask; NUM_CHANNELS won't fit"
+#endif
+
+// Idle suspension. Once the mixer has been writing nothing but silence for idleLimit bytes'
+// worth of audio, it pauses the device with SDL_PauseAudioDevice, and any play command unpauses
+// it again. Don't expect miracles from this: SDL2's audio thread keeps running at full rate
+// while paused (it just writes silence itself instead of calling us), so all we actually save
+// over the idle fast path is our own callback overhead. Properly letting the hardware sleep
+// would mean closing the device, or stopping the stream at the backend level; not done here.
+static SDL_atomic_t suspended; // 1 => device paused by us (NOT by the user)
+static SDL_atomic_t idleLimit; // bytes of silence before suspending; 0 => never
+static int idleTimeout = DEFAULT_IDLE_TIMEOUT; // the same, in ms; what the user actually set
+static int idleBytes = 0; // silence written so far. Callback-only, so no lock.
+
+// Positional emitters. The game thread computes a set of gains for every emitter in one go
+// (UpdateEmitters), and hands the whole set to the callback at once through a triple buffer:
+// - the game thread owns the "back" slot and fills it in;
+// - publishing swaps back with the "middle" slot, flagging it fresh;
+// - the callback swaps its "front" slot with middle whenever middle is fresh.
+// Nobody ever waits on anybody, nobody takes a channel lock, and the callback always sees a
+// complete, consistent frame's worth of gains; never half of one frame and half of the next.
+typedef struct {
+	uint8_t enabled; // 0 => not an emitter; use the channel's own panning
+	uint8_t left; // gains, 0 to MAX_VOL
+	uint8_t right;
+} emitter_gains;
+#define EMITTERS_DIRTY 4 // flag on emitterMiddle; the low bits are the slot index
+static emitter_gains emitterSlots[3][NUM_CHANNELS];
+static int emitterBack; // game thread only
+static SDL_atomic_t emitterMiddle;
+static int emitterFront; // callback only
+
+// Emitter settings and latest results. Game thread only, so no locks.
+static uint8_t emitterRegistered[NUM_CHANNELS];
+// The distance settings are always valid numbers, registered or not (see InitMixer), so that
+// UpdateEmitters can crunch every slot without checking which ones are registered.
+static float emitterRef[NUM_CHANNELS]; // full volume inside this distance
+static float emitterMax[NUM_CHANNELS]; // silent beyond this distance
+static float emitterInvRange[NUM_CHANNELS]; // 1 / (max - ref), so there's no divide per update
+static float emitterLeft[NUM_CHANNELS]; // last computed gains, 0 to 1
+static float emitterRight[NUM_CHANNELS];
+
+#ifdef ORG_MIXER_STATS
+// Timing stats. See GetMixerStats in the header.
+// Each set of samples goes into a histogram of microsecond values: four buckets per power of
+// two, so about 19% resolution at worst. Samples are capped at UINT32_MAX microseconds (about
+// 71 minutes), which the top buckets cover with room to spare. Fixed size, no allocation, and
+// recording a sample is a couple of shifts; fine for the audio thread. Only the callback
+// writes these.
+#define STATS_BUCKETS 128
+typedef struct {
+	uint32_t buckets[STATS_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+} timing_histogram;
+static timing_histogram latencyStats; // PlayChunk => callback that first mixes it
+static timing_histogram callbackStats; // time spent in MixCallback
+static uint64_t playStamps[NUM_CHANNELS]; // when PlayChunk was called; 0 => already counted
+static uint64_t callbackStart; // when the current callback started
+static uint64_t mixStart; // when it got all the channel locks and actually started mixing
+static uint64_t perfFrequency; // SDL_GetPerformanceFrequency, cached
+#endif
 
 // Default log filenames. Extern in header.
 char * mixerLogname = "mixer.log";
 char * callbackLogname = "mixer.callback.log";
 
 
-/*
-	TODO: Implement panning.
- */
+// Split a channel volume into left/right volumes according to panning. Panning only ever cuts
+// the far side; centered means both sides at full volume, same as no panning at all.
+static void PanVolume(int volume, int8_t panning, int * left, int * right) {
+	*left = volume;
+	*right = volume;
+	if (panning > 0) {
+		*left = volume * (FULL_RIGHT - panning) / FULL_RIGHT;
+	} else if (panning < 0) {
+		*right = volume * (panning - FULL_LEFT) / FULL_RIGHT;
+	}
+}
+
+// SDL_MixAudioFormat with separate volumes for left and right.
+// SDL only does one volume for everything, so for stereo S16 and F32 (i.e. anything we
+// actually use) we do the mixing ourselves, the same way SDL does it. Any other format, or
+// mono, just gets the average; better than nothing. If both sides match, SDL does the lot.
+static void MixPanned(uint8_t * dst, const char * src, int len, int left, int right) {
+	if (left == right || audiospec.channels != 2) {
+		SDL_MixAudioFormat(dst, (const uint8_t *)src, audiospec.format, len, (left + right) / 2);
+		return;
+	}
+
+	int frames = len / (2 * (SDL_AUDIO_BITSIZE(audiospec.format) / 8));
+	int f;
+	if (audiospec.format == AUDIO_S16SYS) {
+		int16_t * d = (int16_t *)dst;
+		const int16_t * s = (const int16_t *)src;
+		for (f = 0; f < frames; f++) {
+			int l = d[2*f] + s[2*f] * left / MAX_VOL;
+			int r = d[2*f + 1] + s[2*f + 1] * right / MAX_VOL;
+			d[2*f] = l > INT16_MAX ? INT16_MAX : (l < INT16_MIN ? INT16_MIN : l);
+			d[2*f + 1] = r > INT16_MAX ? INT16_MAX : (r < INT16_MIN ? INT16_MIN : r);
+		}
+	} else if (audiospec.format == AUDIO_F32SYS) {
+		// SDL doesn't clip floats to [-1, 1] while mixing, only to the float range, so neither
+		// do we; otherwise panned channels would clip the mix and unpanned ones wouldn't.
+		// The arithmetic is SDL's too (scale in float, sum in double) so the two paths agree.
+		float * d = (float *)dst;
+		const float * s = (const float *)src;
+		const float fmaxvolume = 1.0f / MAX_VOL;
+		const float lvol = (float)left;
+		const float rvol = (float)right;
+		for (f = 0; f < frames; f++) {
+			double l = (double)(s[2*f] * lvol * fmaxvolume) + (double)d[2*f];
+			double r = (double)(s[2*f + 1] * rvol * fmaxvolume) + (double)d[2*f + 1];
+			d[2*f] = (float)(l > FLT_MAX ? FLT_MAX : (l < -FLT_MAX ? -FLT_MAX : l));
+			d[2*f + 1] = (float)(r > FLT_MAX ? FLT_MAX : (r < -FLT_MAX ? -FLT_MAX : r));
+		}
+	} else {
+		SDL_MixAudioFormat(dst, (const uint8_t *)src, audiospec.format, len, (left + right) / 2);
+	}
+}
+
+
+// Queue internals. See queueHeads et al. above.
+// Push is safe from any thread, no lock needed.
+static void QueuePush(int channelid, mix_chunk * chunk) {
+	SDL_AtomicSetPtr(&chunk->queueNext, NULL);
+	mix_chunk * prev = (mix_chunk *)SDL_AtomicSetPtr(&queueTails[channelid], chunk);
+	// Between these two lines the queue is briefly "broken": the tail has moved on but prev
+	// doesn't point to it yet. QueuePop knows about this.
+	SDL_AtomicSetPtr(&prev->queueNext, chunk);
+}
+// Pop and peek need the channel lock.
+static mix_chunk * QueuePop(int channelid) {
+	mix_chunk * stub = &queueStubs[channelid];
+	mix_chunk * head = queueHeads[channelid];
+	mix_chunk * next = (mix_chunk *)SDL_AtomicGetPtr(&head->queueNext);
+
+	if (head == stub) { // skip over the stub
+		if (next == NULL) {
+			return NULL; // empty
+		}
+		queueHeads[channelid] = head = next;
+		next = (mix_chunk *)SDL_AtomicGetPtr(&head->queueNext);
+	}
+	if (next != NULL) {
+		queueHeads[channelid] = next;
+		return head;
+	}
+
+	// head is the last chunk in the queue. We can't unlink it without something to replace it,
+	// so put the stub back in behind it first.
+	if (head != (mix_chunk *)SDL_AtomicGetPtr(&queueTails[channelid])) {
+		// Someone's mid-push. Rather than spin on the audio thread, just give up; we'll get it
+		// next time around.
+		return NULL;
+	}
+	QueuePush(channelid, stub);
+	next = (mix_chunk *)SDL_AtomicGetPtr(&head->queueNext);
+	if (next != NULL) {
+		queueHeads[channelid] = next;
+		return head;
+	}
+	return NULL; // another mid-push snuck in after the stub; same deal as above
+}
+static int QueueEmpty(int channelid) {
+	mix_chunk * head = queueHeads[channelid];
+	return head == &queueStubs[channelid] && SDL_AtomicGetPtr(&head->queueNext) == NULL;
+}
+
+// Free a finished chunk and/or its buffer, if it asked for that.
+static void FinishChunk(mix_chunk * chunk) {
+	if (chunk->deallocate_buf) {
+		free(chunk->buf);
+	}
+	if (chunk->deallocate_me) {
+		free(chunk);
+	}
+}
+
+// Reset a chunk to play from the top, loop count and all.
+static void RewindChunk(mix_chunk * chunk) {
+	chunk->bufpos = 0;
+	chunk->loopsdone = 0;
+}
+
+// Where the current pass through chunk stops, in bytes: loopend if it's still got loops left
+// to do, or the end of the buffer otherwise. *looping says which.
+// A loop that's empty or backwards, or that we're already past, is treated as no loop at all;
+// otherwise a bad loopend could have the callback spinning forever.
+static int PassEnd(mix_chunk * chunk, int * looping) {
+	int loopend = chunk->loopend > 0 ? chunk->loopend : chunk->buflen;
+	*looping = chunk->loops != 0
+		&& (chunk->loops == LOOP_FOREVER || chunk->loopsdone < chunk->loops)
+		&& chunk->loopstart >= 0
+		&& loopend <= chunk->buflen
+		&& loopend > chunk->loopstart
+		&& chunk->bufpos < loopend;
+	return *looping ? loopend : chunk->buflen;
+}
+
+// Recompute whether channelid is active and update its bit in activeChannels.
+// Caller must hold the channel's lock.
+static void UpdateActive(int channelid) {
+	int bit = 1 << channelid;
+	int active = channels[channelid].playing &&
+		(channels[channelid].chunk != NULL || !QueueEmpty(channelid));
+	int oldmask, newmask;
+	do {
+		oldmask = SDL_AtomicGet(&activeChannels);
+		newmask = active ? (oldmask | bit) : (oldmask & ~bit);
+	} while (!SDL_AtomicCAS(&activeChannels, oldmask, newmask));
+}
+
+// Unpause the device if the idle suspension put it to sleep. The CAS makes sure only one
+// thread does the unpausing. Call this AFTER releasing channel locks: SDL_PauseAudioDevice
+// waits for the callback to finish, and the callback waits on the channel locks...
+static void WakeDevice(void) {
+	if (SDL_AtomicCAS(&suspended, 1, 0)) {
+		SDL_PauseAudioDevice(deviceID, 0);
+	}
+}
+
+// Convert idleTimeout into bytes of audio. Needs audiospec, so only meaningful once opened.
+static void UpdateIdleLimit(void) {
+	int framesize = (SDL_AUDIO_BITSIZE(audiospec.format) / 8) * audiospec.channels;
+	int64_t limit = (int64_t)idleTimeout * audiospec.freq / 1000 * framesize;
+	if (limit > INT_MAX) {
+		limit = INT_MAX;
+	}
+	SDL_AtomicSet(&idleLimit, (int)limit);
+}
+
+// The idle fast path. Called from the callback when no channel is active.
+static void MixSilence(uint8_t * stream, int len) {
+	// Same silence the regular path would write, so output is identical either way.
+	memset((void *)stream, 0, len);
+
+	int limit = SDL_AtomicGet(&idleLimit);
+	if (limit <= 0 || deviceID == 0) {
+		return; // suspension disabled, or headless (nothing to suspend)
+	}
+
+	// Compare against what's left rather than adding first: limit can be as big as INT_MAX,
+	// and idleBytes + len would overflow on the way there. idleBytes stays below limit, so the
+	// subtraction can't.
+	if (len < limit - idleBytes) {
+		idleBytes += len;
+		return;
+	}
+	idleBytes = 0;
+
+	// Time for a nap. Note that we're calling this from inside the audio callback; that's fine
+	// since SDL's device lock is recursive and this thread already holds it.
+	// Ordering matters here! Pause first, THEN flag it, THEN check for activity. A play command
+	// sets its active bit first and checks the flag second, so either it sees the flag and
+	// wakes the device itself, or we see its bit here and wake the device ourselves.
+	logprintf(cbHandle, "Idle for too long, suspending device\n");
+	SDL_PauseAudioDevice(deviceID, 1);
+	SDL_AtomicSet(&suspended, 1);
+	if ((SDL_AtomicGet(&activeChannels) | SDL_AtomicGet(&queuedChannels)) != 0) {
+		WakeDevice();
+	}
+}
 
 
+#ifdef ORG_MIXER_STATS
+// Histogram bucket for a value, and the largest value that lands in a bucket. Values under 4
+// get a bucket each; above that, bucket 4*(log2(v)-1) + (the next two bits down).
+static int StatsBucket(uint32_t us) {
+	if (us < 4) {
+		return us;
+	}
+	int msb = 31;
+	while (!(us & (1u << msb))) {
+		msb--;
+	}
+	return 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+}
+static uint32_t StatsBucketTop(int bucket) {
+	if (bucket < 4) {
+		return bucket;
+	}
+	int msb = bucket / 4 + 1;
+	uint64_t top = ((uint64_t)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
+	return top > UINT32_MAX ? UINT32_MAX : (uint32_t)top;
+}
+static void StatsRecord(timing_histogram * hist, uint64_t ticks) {
+	// Split up so long intervals don't overflow the multiply
+	uint64_t us = ticks / perfFrequency * 1000000 + ticks % perfFrequency * 1000000 / perfFrequency;
+	uint32_t val = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+	hist->buckets[StatsBucket(val)]++;
+	hist->count++;
+	if (val > hist->max) {
+		hist->max = val;
+	}
+}
+// Value at the given percentile, rounded UP to the top of its bucket (but never past the max).
+static uint32_t StatsPercentile(const timing_histogram * hist, int percent) {
+	if (hist->count == 0) {
+		return 0;
+	}
+	uint64_t target = ((uint64_t)hist->count * percent + 99) / 100; // ceil
+	uint64_t seen = 0;
+	int b;
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		seen += hist->buckets[b];
+		if (seen >= target) {
+			uint32_t top = StatsBucketTop(b);
+			return top < hist->max ? top : hist->max;
+		}
+	}
+	return hist->max;
+}
+#endif
+
+static void MixStream(uint8_t * stream, int len);
+
 // Callback used by the mixer to actually mix the audio.
+// The real work happens in MixStream; this just wraps it for timing, when that's compiled in.
 static void MixCallback (void * UNUSED, uint8_t * stream, int len) {
+#ifdef ORG_MIXER_STATS
+	callbackStart = SDL_GetPerformanceCounter();
+	MixStream(stream, len);
+	StatsRecord(&callbackStats, SDL_GetPerformanceCounter() - callbackStart);
+#else
+	MixStream(stream, len);
+#endif
+}
+
+static void MixStream(uint8_t * stream, int len) {
 	logprintf(cbHandle, "Callback called!\n");
 
+	// Nothing playing anywhere? Then there's nothing to lock and nothing to mix.
+	if ((SDL_AtomicGet(&activeChannels) | SDL_AtomicGet(&queuedChannels)) == 0) {
+		MixSilence(stream, len);
+		return;
+	}
+	idleBytes = 0;
+
 	// First order of business: acquire locks on all of the channels
 	logprintf(cbHandle, "Acquiring semaphores\n");
 	int i, ret;
@@ -66,6 +418,20 @@ static void MixCallback (void * UNUSED, uint8_t * stream, int len) {
 		ret = sem_wait(&channelLocks[i]);
 	}
 	logprintf(cbHandle, "Acquired\n");
+#ifdef ORG_MIXER_STATS
+	// Latency is measured from here, not from callbackStart. A PlayChunk can sneak in while
+	// we're waiting on its lock, and its stamp would then be later than callbackStart.
+	mixStart = SDL_GetPerformanceCounter();
+#endif
+
+	// Anything enqueued before this point is visible to QueuePop now; anything after will
+	// set its bit again and get picked up next time.
+	SDL_AtomicSet(&queuedChannels, 0);
+
+	// Pick up the latest emitter gains, if there are any
+	if (SDL_AtomicGet(&emitterMiddle) & EMITTERS_DIRTY) {
+		emitterFront = SDL_AtomicSet(&emitterMiddle, emitterFront) & ~EMITTERS_DIRTY;
+	}
 
 	// Begin by silencing out the stream. In SDL2.0, the stream is not automatically initialized
 	// with silence.
@@ -84,19 +450,36 @@ static void MixCallback (void * UNUSED, uint8_t * stream, int len) {
 			continue; // nothin' to do cap'n
 		}
 
+		// Work out the left/right volumes. Emitters override the channel's own panning.
+		int leftvol, rightvol;
+		emitter_gains * gains = &emitterSlots[emitterFront][i];
+		if (gains->enabled) {
+			leftvol = channels[i].volume * gains->left / MAX_VOL;
+			rightvol = channels[i].volume * gains->right / MAX_VOL;
+		} else {
+			PanVolume(channels[i].volume, channels[i].panning, &leftvol, &rightvol);
+		}
+
 		int streampos = 0;
 		int bytestogo = len;
 		while (bytestogo > 0) { // loop until we've filled the entire buffer
 			mix_chunk * curChunk = channels[i].chunk;
 			if (curChunk == NULL) {
-				logprintf(cbHandle, "No chunk on current channel, moving to next channel\n");
-				break; // nothin' to do cap'n; reiterates outer loop
+				// Chain's done; see if anything's been queued up behind it
+				curChunk = QueuePop(i);
+				if (curChunk == NULL) {
+					logprintf(cbHandle, "No chunk on current channel, moving to next channel\n");
+					break; // nothin' to do cap'n; reiterates outer loop
+				}
+				logprintf(cbHandle, "Took chunk from queue\n");
+				RewindChunk(curChunk);
+				channels[i].chunk = curChunk;
 			}
 
-			uint8_t volume = channels[i].volume;//*(curChunk->volume/255);
 			char * chunkBuf = curChunk->buf + curChunk->bufpos;
-			int buflen = curChunk->buflen - curChunk->bufpos;
-			logprintf(cbHandle, "Volume: %d\n", volume);
+			int looping;
+			int buflen = PassEnd(curChunk, &looping) - curChunk->bufpos; // bytes left this pass
+			logprintf(cbHandle, "Volume: %d/%d\n", leftvol, rightvol);
 			logprintf(cbHandle, "streampos: %d\n", streampos);
 			logprintf(cbHandle, "bytestogo: %d\n", bytestogo);
 			logprintf(cbHandle, "buflen: %d\n", buflen);
@@ -104,21 +487,34 @@ static void MixCallback (void * UNUSED, uint8_t * stream, int len) {
 			if (buflen > bytestogo) {
 				// Mix in buffer, update bufpos, and quit
 				logprintf(cbHandle, "buflen > bytestogo, mixing and breaking\n");
-				SDL_MixAudioFormat(stream + streampos, chunkBuf, audiospec.format, bytestogo, volume);
+				MixPanned(stream + streampos, chunkBuf, bytestogo, leftvol, rightvol);
 				curChunk->bufpos += bytestogo;
 				bytestogo = 0;
 				break;
 			} else if (buflen == bytestogo) {
 				logprintf(cbHandle, "buflen == bytestogo, mixing and updating\n");
 				// Mix in buffer, update to next chunk, and quit
-				SDL_MixAudioFormat(stream + streampos, chunkBuf, audiospec.format, bytestogo, volume);
+				MixPanned(stream + streampos, chunkBuf, bytestogo, leftvol, rightvol);
 				bytestogo = 0;
 			} else {
 				logprintf(cbHandle, "buflen < bytestogo, mixing and updating\n");
 				// Mix in what's left, then update to next chunk
-				SDL_MixAudioFormat(stream + streampos, chunkBuf, audiospec.format, buflen, volume);
+				MixPanned(stream + streampos, chunkBuf, buflen, leftvol, rightvol);
 				bytestogo -= buflen;
 			}
+
+			if (looping) {
+				// Hit the loop end. Wrap back to the loop start and keep mixing, right here;
+				// as far as the rest of the mixer's concerned the chunk never ended, so no
+				// callback, no chain advance, no deallocation checks.
+				logprintf(cbHandle, "Reached loop end, wrapping\n");
+				streampos += buflen;
+				curChunk->bufpos = curChunk->loopstart;
+				if (curChunk->loops != LOOP_FOREVER) {
+					curChunk->loopsdone++;
+				}
+				continue;
+			}
 			// If the code reaches this point, we exhausted the current chunk on this channel.
 			// Update to the next chunk. If it's empty, manually break loop.
 			// Do whatever else is necessary on chunk-end (see below)
@@ -139,24 +535,30 @@ static void MixCallback (void * UNUSED, uint8_t * stream, int len) {
 			if (curChunk->nextChunk != NULL) {
 				logprintf(cbHandle, "Moving to next chunk in the chain\n");
 				channels[i].chunk = curChunk->nextChunk;
-				channels[i].chunk->bufpos = 0; // Necessary in case a chunk loops back on itself...
+				RewindChunk(channels[i].chunk); // Necessary in case a chunk loops back on itself...
 				continue;
-			} else if (chunkstacks[i].size > 0) {
+			} else if (interruptDepth[i] > 0) {
 				logprintf(cbHandle, "Popping old chunk off the stack\n");
-				channels[i].chunk = (mix_chunk *)voidpop(&chunkstacks[i]);
+				channels[i].chunk = interruptStacks[i][--interruptDepth[i]];
 			} else {
 				logprintf(cbHandle, "No more chunks\n");
 				channels[i].chunk = NULL;
 			}
 
 			// Free current chunk/buffer if applicable
-			if (curChunk->deallocate_buf) {
-				free(curChunk->buf);
-			}
-			if (curChunk->deallocate_me) {
-				free(curChunk);
-			}
+			FinishChunk(curChunk);
 		}
+
+#ifdef ORG_MIXER_STATS
+		// First time mixing something since PlayChunk? That's our latency sample.
+		if (playStamps[i] != 0 && bytestogo < len) {
+			// Every PlayChunk stamp was taken under a lock we now hold, so it should be
+			// earlier than mixStart; clamp anyway rather than record a wrapped-around value.
+			uint64_t stamp = playStamps[i];
+			StatsRecord(&latencyStats, mixStart > stamp ? mixStart - stamp : 0);
+			playStamps[i] = 0;
+		}
+#endif
 	}
 	// Note: Process when chunk is finished on a channel:
 	// - Call callback, if not null
@@ -164,12 +566,18 @@ static void MixCallback (void * UNUSED, uint8_t * stream, int len) {
 	// - Else if nextChunk not null, begin playing nextChunk
 	//   - Deallocate current chunkbuffer/chunk as applicable
 	// - Else: check if there are any chunks in interrupt stack. Pop and play if applicable.
+	// - Else: check if there are any chunks in the queue. Dequeue and play if applicable.
 	// - Else: null out chunk field; fill rest of buffer with silence.
 
 	// Queueing the same chunk to multiple channels gives undefined behaviour, for now.
 	// I can only do so much to prevent shooting myself in the foot...
 
 
+	// Chunks may have run out while mixing; refresh the active bits while we still hold the locks.
+	for (i = 0; i < NUM_CHANNELS; i++) {
+		UpdateActive(i);
+	}
+
 	// Release all locks and exit the method
 	logprintf(cbHandle, "Releasing semaphores...\n");
 	for (i = 0; i < NUM_CHANNELS; i++) {
@@ -186,19 +594,20 @@ mix_chunk * allocate_chunk() {
 	chunk->deallocate_buf = 0;
 	chunk->deallocate_me = 0;
 	chunk->bufpos = 0;
+	chunk->loopstart = 0;
+	chunk->loopend = 0;
+	chunk->loops = 0;
+	chunk->loopsdone = 0;
 	chunk->callback = NULL;
 	chunk->nextChunk = NULL;
+	chunk->queueNext = NULL;
 
 	return chunk;
 }
 
-// INITIALIZE
-int org_OpenAudio (int frequency, SDL_AudioFormat format, int devicechannels, int chunksize) {
-
-	if (initialized) {
-		return rSORRY;
-	}
-
+// Shared setup for both OpenAudio variants: logging, channels, and locks.
+// Doesn't touch the device or the audiospec; that's up to the caller.
+static int InitMixer(void) {
 	// Set up logging first. Whee!
 	logHandle = log_init(mixerLogname);
 	cbHandle = log_init_mode(callbackLogname, _IOFBF);
@@ -218,7 +627,7 @@ int org_OpenAudio (int frequency, SDL_AudioFormat format, int devicechannels, in
 		channels[i].volume = 128; // Initialize at max volume
 		channels[i].reserved = 0;
 		channels[i].playing = 0;
-		//channels[i].panning = 0; TODO: panning ain't implemented yet
+		channels[i].panning = FULL_CENTER;
 
 		ret = sem_init(&channelLocks[i], 0, 1);
 		if (ret) {
@@ -226,8 +635,52 @@ int org_OpenAudio (int frequency, SDL_AudioFormat format, int devicechannels, in
 			return rFAIL;
 		}
 
-		chunkstacks[i].size = 0;
-		chunkstacks[i].top = NULL;
+		interruptDepth[i] = 0;
+
+		queueStubs[i].queueNext = NULL;
+		queueHeads[i] = &queueStubs[i];
+		queueTails[i] = &queueStubs[i];
+	}
+
+	SDL_AtomicSet(&activeChannels, 0);
+	SDL_AtomicSet(&queuedChannels, 0);
+	SDL_AtomicSet(&suspended, 0);
+	idleBytes = 0;
+
+	// No emitters to start with
+	memset(emitterSlots, 0, sizeof(emitterSlots));
+	for (i = 0; i < NUM_CHANNELS; i++) {
+		emitterRegistered[i] = 0;
+		emitterRef[i] = 1.0f;
+		emitterMax[i] = 2.0f;
+		emitterInvRange[i] = 1.0f;
+		emitterLeft[i] = 1.0f;
+		emitterRight[i] = 1.0f;
+	}
+	emitterFront = 0;
+	SDL_AtomicSet(&emitterMiddle, 1);
+	emitterBack = 2;
+
+#ifdef ORG_MIXER_STATS
+	memset(&latencyStats, 0, sizeof(latencyStats));
+	memset(&callbackStats, 0, sizeof(callbackStats));
+	memset(playStamps, 0, sizeof(playStamps));
+	perfFrequency = SDL_GetPerformanceFrequency();
+#endif
+
+	return rSUCCESS;
+}
+
+// INITIALIZE
+int org_OpenAudio (int frequency, SDL_AudioFormat format, int devicechannels, int chunksize) {
+
+	if (initialized) {
+		return rSORRY;
+	}
+
+	int ret = InitMixer();
+	if (ret != rSUCCESS) {
+		return ret;
 	}
 
 	// Try to get the correct audio output.
@@ -249,8 +702,10 @@ int org_OpenAudio (int frequency, SDL_AudioFormat format, int devicechannels, in
 		logprintf(logHandle, "Error opening audio device!\n");
 		logprintf(logHandle, SDL_GetError());
 		logprintf(logHandle, "Returning rSDLERR...\n");
+		deviceID = 0;
 		return rSDLERR;
 	}
+	UpdateIdleLimit();
 	SDL_PauseAudioDevice(deviceID, 0); // Listen to my song!
 
 	initialized = 1;
@@ -258,6 +713,52 @@ int org_OpenAudio (int frequency, SDL_AudioFormat format, int devicechannels, in
 	return rSUCCESS;
 }
 
+// INITIALIZE, but without any hardware attached
+int org_OpenAudioHeadless (int frequency, SDL_AudioFormat format, int devicechannels, int chunksize) {
+
+	if (initialized) {
+		return rSORRY;
+	}
+
+	int ret = InitMixer();
+	if (ret != rSUCCESS) {
+		return ret;
+	}
+
+	// No device, so no negotiation; the spec is exactly what was asked for. This is the whole
+	// point: output depends only on the parameters and the chunks, not on whatever the sound
+	// card felt like giving us today.
+	audiospec.freq = frequency;
+	audiospec.format = format;
+	audiospec.channels = devicechannels;
+	audiospec.silence = 0;
+	audiospec.samples = chunksize;
+	audiospec.padding = 0;
+	audiospec.size = (SDL_AUDIO_BITSIZE(format) / 8) * devicechannels * chunksize;
+	audiospec.callback = MixCallback;
+	audiospec.userdata = NULL;
+
+	deviceID = 0; // Nothing opened; org_CloseAudio checks for this.
+	UpdateIdleLimit(); // harmless; MixSilence never suspends without a device
+
+	initialized = 1;
+	logprintf(logHandle, "Finished initializing headless mixer.\n");
+	return rSUCCESS;
+}
+
+// Pump the mixer by hand. Only valid in headless mode.
+int org_RenderAudio (uint8_t * stream, int len) {
+	if (!initialized || deviceID != 0) {
+		return rSORRY; // there's a real callback running; don't race it
+	}
+	if (stream == NULL || len < 0) {
+		return rBADARG;
+	}
+
+	MixCallback(NULL, stream, len);
+	return rSUCCESS;
+}
+
 /*
 	Channel	management functions.
 
@@ -356,11 +857,16 @@ mix_chunk * PlayChunk(int channelid, mix_chunk * chunk) {
 	} while (ret != 0);
 
 	mix_chunk * oldchunk = channels[channelid].chunk;
-	chunk->bufpos = 0;
+	RewindChunk(chunk);
 	channels[channelid].chunk = chunk;
 	channels[channelid].playing = 1;
+	UpdateActive(channelid);
+#ifdef ORG_MIXER_STATS
+	playStamps[channelid] = SDL_GetPerformanceCounter();
+#endif
 
 	sem_post(&channelLocks[channelid]);
+	WakeDevice();
 
 	return oldchunk;
 }
@@ -374,8 +880,10 @@ mix_chunk * SetChunk(int channelid, mix_chunk * chunk) {
 	mix_chunk * oldchunk = channels[channelid].chunk;
 	channels[channelid].chunk = chunk;
 	channels[channelid].playing = 1;
+	UpdateActive(channelid);
 
 	sem_post(&channelLocks[channelid]);
+	WakeDevice();
 
 	return oldchunk;
 }
@@ -386,11 +894,37 @@ int InterruptChunk(int channelid, mix_chunk * chunk) {
 		ret = sem_wait(&channelLocks[channelid]);
 	} while (ret != 0);
 
+	if (interruptDepth[channelid] >= MAX_INTERRUPTS) {
+		sem_post(&channelLocks[channelid]);
+		return rSORRY; // stack's full; no allocating our way out of it
+	}
+
 	mix_chunk * oldchunk = channels[channelid].chunk;
 	channels[channelid].chunk = chunk;
-	voidpush(&chunkstacks[channelid], (void *)oldchunk);
+	interruptStacks[channelid][interruptDepth[channelid]++] = oldchunk;
+	UpdateActive(channelid);
 
 	sem_post(&channelLocks[channelid]);
+	WakeDevice();
+
+	return rSUCCESS;
+}
+
+// Queue a chunk up behind whatever's on the channel. Lock-free!
+int EnqueueChunk(int channelid, mix_chunk * chunk) {
+	if (channelid < 0 || channelid >= NUM_CHANNELS || chunk == NULL) {
+		return rBADARG;
+	}
+
+	QueuePush(channelid, chunk);
+
+	// Flag it for the callback, so the idle fast path doesn't skip over it.
+	int bit = 1 << channelid;
+	int oldmask;
+	do {
+		oldmask = SDL_AtomicGet(&queuedChannels);
+	} while (!SDL_AtomicCAS(&queuedChannels, oldmask, oldmask | bit));
+	WakeDevice();
 
 	return rSUCCESS;
 }
@@ -403,6 +937,7 @@ int PauseChannel(int channelid) {
 	} while (ret != 0);
 
 	channels[channelid].playing = 0;
+	UpdateActive(channelid);
 
 	sem_post(&channelLocks[channelid]);
 
@@ -417,8 +952,10 @@ int PlayChannel(int channelid) {
 	} while (ret != 0);
 
 	channels[channelid].playing = 1;
+	UpdateActive(channelid);
 
 	sem_post(&channelLocks[channelid]);
+	WakeDevice();
 
 	return rSUCCESS;
 }
@@ -443,7 +980,121 @@ uint16_t SetVolume(int channelid, uint8_t volume) {
 
 // Set panning for a channel
 int8_t SetPanning(int channelid, int8_t panning) {
-	return rFAIL; // TODO: not yet implemented
+	// -128 doesn't have a matching +128; cap it so left and right are symmetric
+	if (panning < FULL_LEFT) { panning = FULL_LEFT; }
+
+	int ret;
+	do {
+		ret = sem_wait(&channelLocks[channelid]);
+	} while (ret != 0);
+
+	int8_t tmppan = channels[channelid].panning;
+	channels[channelid].panning = panning;
+
+	sem_post(&channelLocks[channelid]);
+
+	return tmppan;
+}
+
+
+
+/*
+	Positional emitters. Game thread only!
+ */
+
+// Branch-free min/max. Not exact to the last bit, but plenty for gains, and unlike fminf or a
+// ternary they vectorize without -ffast-math.
+static inline float FloatMin(float a, float b) {
+	return 0.5f * (a + b - fabsf(a - b));
+}
+static inline float FloatMax(float a, float b) {
+	return 0.5f * (a + b + fabsf(a - b));
+}
+
+// Copy the latest gains into the back slot and hand it over to the callback
+static void PublishEmitters(void) {
+	emitter_gains * slot = emitterSlots[emitterBack];
+	int i;
+	for (i = 0; i < NUM_CHANNELS; i++) {
+		slot[i].enabled = emitterRegistered[i];
+		slot[i].left = (uint8_t)(emitterLeft[i] * MAX_VOL + 0.5f);
+		slot[i].right = (uint8_t)(emitterRight[i] * MAX_VOL + 0.5f);
+	}
+	emitterBack = SDL_AtomicSet(&emitterMiddle, emitterBack | EMITTERS_DIRTY) & ~EMITTERS_DIRTY;
+}
+
+// Make a channel positional
+int RegisterEmitter(int channelid, float refDistance, float maxDistance) {
+	if (channelid < 0 || channelid >= NUM_CHANNELS || refDistance <= 0 || maxDistance <= refDistance) {
+		return rBADARG;
+	}
+
+	emitterRef[channelid] = refDistance;
+	emitterMax[channelid] = maxDistance;
+	emitterInvRange[channelid] = 1.0f / (maxDistance - refDistance);
+	emitterLeft[channelid] = 1.0f; // until we know where it is
+	emitterRight[channelid] = 1.0f;
+	emitterRegistered[channelid] = 1;
+	PublishEmitters(); // so the callback knows it's an emitter now
+
+	return rSUCCESS;
+}
+
+// Make a channel not positional
+int UnregisterEmitter(int channelid) {
+	if (channelid < 0 || channelid >= NUM_CHANNELS) {
+		return rBADARG;
+	}
+
+	emitterRegistered[channelid] = 0;
+	PublishEmitters(); // so it doesn't stay stuck at its old gains until the next update
+
+	return rSUCCESS;
+}
+
+// Move everything around
+void UpdateEmitters(mix_vec2 listener, const mix_vec2 * positions, int count) {
+	if (count > NUM_CHANNELS) { count = NUM_CHANNELS; }
+
+	// Do the maths for every slot, registered or not; unregistered results never get
+	// published as anything but disabled, so it doesn't matter what they come out as.
+	// This loop is written so the compiler can vectorize it: no branches, no per-slot
+	// registration checks, and the clamps are FloatMin/FloatMax rather than ternaries, since
+	// a float comparison can trap and that's enough to stop GCC turning it into a select.
+	// sqrtf still needs -fno-math-errno (or -ffast-math) to vectorize, because of errno.
+	int i;
+	for (i = 0; i < count; i++) {
+		float dx = positions[i].x - listener.x;
+		float dy = positions[i].y - listener.y;
+		float dist = sqrtf(dx*dx + dy*dy);
+
+		// Attenuation: linear falloff from full volume at ref to silence at max
+		float gain = (emitterMax[i] - dist) * emitterInvRange[i];
+		gain = FloatMax(FloatMin(gain, 1.0f), 0.0f);
+
+		// Pan: how far off to the side it is. Within ref, ease off, so something sitting right
+		// on top of the listener doesn't flip-flop between hard left and hard right.
+		float pan = dx / FloatMax(dist, emitterRef[i]);
+
+		// Same law as PanVolume; only the far side gets cut
+		emitterLeft[i] = gain * FloatMin(1.0f - pan, 1.0f);
+		emitterRight[i] = gain * FloatMin(1.0f + pan, 1.0f);
+	}
+
+	PublishEmitters();
+}
+
+// Set how long the mixer idles before suspending the device
+int SetIdleTimeout(int ms) {
+	if (ms < 0) { ms = 0; }
+
+	int oldtimeout = idleTimeout;
+	idleTimeout = ms;
+	if (initialized) {
+		UpdateIdleLimit();
+	}
+
+	return oldtimeout;
 }
 
 // Stop a channel
@@ -459,6 +1110,16 @@ mix_chunk * StopChannel(int channelid) {
 	oldchunk = channels[channelid].chunk;
 	channels[channelid].chunk = NULL;
 	channels[channelid].playing = 0;
+	// Drop anything queued up, too. The caller only gets the current chunk back, so queued
+	// chunks have no way back to whoever queued them; clean them up like they'd finished.
+	mix_chunk * queued;
+	while ((queued = QueuePop(channelid)) != NULL) {
+		FinishChunk(queued);
+	}
+	UpdateActive(channelid);
+#ifdef ORG_MIXER_STATS
+	playStamps[channelid] = 0; // never made it out; don't count it
+#endif
 
 	sem_post(&channelLocks[channelid]);
 
@@ -481,8 +1142,10 @@ void org_CloseAudio() {
 
 	logprintf(logHandle, "CLOSING MIXER\n");
 
-	logprintf(logHandle, "Closing audio device...\n");
-	SDL_CloseAudioDevice(deviceID);
+	if (deviceID != 0) { // headless mixers never opened one
+		logprintf(logHandle, "Closing audio device...\n");
+		SDL_CloseAudioDevice(deviceID);
+	}
 
 	// Release all semaphores
 	logprintf(logHandle, "Releasing semaphores...\n");
@@ -492,6 +1155,9 @@ void org_CloseAudio() {
 	}
 	deviceID = 0;
 	initialized = 0;
+	SDL_AtomicSet(&activeChannels, 0);
+	SDL_AtomicSet(&queuedChannels, 0);
+	SDL_AtomicSet(&suspended, 0);
 
 	logprintf(logHandle, "Done closing mixer. Have a nice day!\n");
 	// Close down logging...
@@ -512,6 +1178,9 @@ int GetDeviceID() {
 int CheckInitialized() {
 	return initialized;
 }
+int CheckSuspended() {
+	return SDL_AtomicGet(&suspended);
+}
 
 void GetChannelDetails(int chanNum, mix_channel * dest) {
 	int ret;
@@ -526,10 +1195,36 @@ void GetMixerSpec(SDL_AudioSpec * dest) {
 	memcpy((void *)dest, (void *)&audiospec, sizeof(SDL_AudioSpec));
 }
 
+#ifdef ORG_MIXER_STATS
+static void StatsSummarize(const timing_histogram * hist, mix_timing * dest) {
+	dest->count = hist->count;
+	dest->p50 = StatsPercentile(hist, 50);
+	dest->p99 = StatsPercentile(hist, 99);
+	dest->max = hist->max;
+}
+void GetMixerStats(mix_stats * dest) {
+	// The device lock keeps the callback out while we read. (No-op in headless mode, where the
+	// callback only runs when you call org_RenderAudio anyway.)
+	SDL_LockAudioDevice(deviceID);
+	StatsSummarize(&latencyStats, &dest->latency);
+	StatsSummarize(&callbackStats, &dest->callback);
+	SDL_UnlockAudioDevice(deviceID);
+}
+void ResetMixerStats(void) {
+	SDL_LockAudioDevice(deviceID);
+	memset(&latencyStats, 0, sizeof(latencyStats));
+	memset(&callbackStats, 0, sizeof(callbackStats));
+	SDL_UnlockAudioDevice(deviceID);
+}
+#endif
+
 int GetNumStackedChunks(int channel) {
-	return chunkstacks[channel].size;
+	return interruptDepth[channel];
 }
 mix_chunk * GetTopChunk(int channel) {
-	return (mix_chunk *)chunkstacks[channel].top;
+	if (interruptDepth[channel] == 0) {
+		return NULL;
+	}
+	return interruptStacks[channel][interruptDepth[channel] - 1];
 }
 
@@ -19,6 +19,11 @@
 // problem, though, leave it.
 #define NUM_CHANNELS 16
 
+// How many chunks deep each channel's interrupt stack goes. The stack is allocated up front, so
+// InterruptChunk fails once it's full rather than growing. If you're nesting interrupts deeper
+// than this, something has probably gone wrong anyway.
+#define MAX_INTERRUPTS 8
+
 // Log file names. Defaults to "mixer.log" and "mixer.callback.log" respectively.
 extern char * mixerLogname;
 extern char * callbackLogname;
@@ -41,8 +46,18 @@ typedef struct {
 	// Believe it or not, you may want this too!
 	int bufpos; // Internal position in buffer, in bytes; zero-indexed of course. Don't touch!
 
+	// Looping. When playback reaches loopend it jumps back to loopstart, loops times over;
+	// after that it plays through to the end of the buffer as normal. Both are byte offsets
+	// and should land on sample frame boundaries. loopend is exclusive, and 0 means the end of
+	// the buffer. loops = 0 (the default) means don't loop; LOOP_FOREVER means what it says.
+	int loopstart;
+	int loopend;
+	int loops;
+	int loopsdone; // How many times we've looped so far. Don't touch!
+
 	void * (*callback)(int channel, void * chunk); // An optional callback to be called once the chunk is finished
 	void * nextChunk;
+	void * queueNext; // Link used by EnqueueChunk. Internal; don't touch!
 } mix_chunk;
 
 // The use of bufpos is a takeaway from sslib. afaict it exists because sslib allows you to
@@ -79,6 +94,11 @@ typedef struct {
 // when the callback is called again; or load only when the callback is called.
 // - I want to put in the entire song at once!
 // You do you.
+// - I want an intro, and then loop the rest of the song!
+// Put the whole thing in one chunk and set loopstart to where the intro ends. Set loops to
+// LOOP_FOREVER, then stop or replace the chunk when you're done with it. (You COULD chain the
+// intro into a chunk whose nextChunk points to itself, which is how it used to be done, but
+// then every wrap goes through the whole end-of-chunk rigmarole.)
 // You can also load a single song as a linked list of chunks. Put the callback in the last entry
 // so you can be alerted once it's done.
 
@@ -103,7 +123,7 @@ typedef struct {
 	uint8_t reserved;
 	uint8_t playing; // 0 => paused
 
-	//int8_t panning; // 0 = -128 = centered. 127 = full-right. -127 = full-left.
+	int8_t panning; // 0 = centered. 127 = full-right. -127 = full-left.
 
 	// TODO: eventually, stuff for fade-out will be placed here.
 	// I don't need that yet, though.
@@ -111,10 +131,15 @@ typedef struct {
 
 #define MAX_VOL 128
 
+#define LOOP_FOREVER -1
+
 #define FULL_RIGHT 127
 #define FULL_LEFT -127
 #define FULL_CENTER 0
 
+// Default for SetIdleTimeout, in ms.
+#define DEFAULT_IDLE_TIMEOUT 2000
+
 
 /*********
  * Funcs *
@@ -156,6 +181,28 @@ int org_OpenAudio(int frequency, SDL_AudioFormat format, int deviceChannels, int
 // Fun fact: SDL2 will handle device/parameter mismatches behind-the-scenes, so you can pretend
 // like they don't exist!
 
+/*
+	As org_OpenAudio, but doesn't open an audio device at all. The mixer's spec is set to
+	exactly the parameters passed in, and nothing calls the mixing callback on its own; audio
+	only gets produced when you ask for it with org_RenderAudio.
+	Same return codes as org_OpenAudio, minus rSDLERR. Clean up with org_CloseAudio as usual.
+
+	What's it for? Determinism. With no device in the way there's no format negotiation and no
+	timing jitter, so a given sequence of calls always renders the same samples. That makes it
+	possible to check mixer output against known-good renders, or to render offline.
+ */
+int org_OpenAudioHeadless(int frequency, SDL_AudioFormat format, int deviceChannels, int chunksize);
+/*
+	Runs the mixing callback once, filling len bytes of stream. Exactly as if the device had
+	asked for them; chunk callbacks get called, chains advance, etc.
+	len is in bytes and should be a whole number of sample frames. To mimic a real device, use
+	chunksize frames per call (i.e. the spec's size field; see GetMixerSpec).
+
+	Returns rSORRY if the mixer isn't open in headless mode (a real device has its own callback
+	and we're not going to race it); rBADARG on a NULL stream; rSUCCESS otherwise.
+ */
+int org_RenderAudio(uint8_t * stream, int len);
+
 /*
 	Channel management part the first. Find a free channel, returns integer ID.
 	Returns the integer ID, or NUM_CHANNELS if none are available. (Channels are zero-indexed.)
@@ -202,10 +249,27 @@ mix_chunk * SetChunk(int channelid, mix_chunk * chunk);
 	As PlayChunk, but INTERRUPTS the currently-playing chunkchain.
 	The other chain will resume playing after this one completes.
 	Useful if you need n seconds of silence, mostly.
-	Returns rSUCCESS on success, error code on failure.
+	Returns rSUCCESS on success, error code on failure. In particular, returns rSORRY if the
+	channel already has MAX_INTERRUPTS chunks stacked up.
 	Does not unpause the channel, since it assumes the channel is currently playing.
  */
 int InterruptChunk(int channelid, mix_chunk * chunk);
+/*
+	Queues chunk to play once everything currently on the channel is done; that is, once the
+	current chain has run out and the interrupt stack is empty. Chunks enqueued this way play
+	in order, each with its own nextChunk chain.
+	Unlike everything else here, this does NOT acquire the channel lock, and it's O(1) no matter
+	how much is already queued; it never walks the chain or allocates anything. So it's safe to
+	call as often as you like, from any thread, even while the channel is playing.
+	Doesn't unpause the channel. PlayChunk/SetChunk replace the current chain but leave the
+	queue alone. StopChannel drops the queue, freeing each dropped chunk and/or its buffer
+	according to its deallocate flags, as if it had finished. (Only the queued chunks
+	themselves; any nextChunk chains hanging off them are left alone.)
+	A chunk can only be in one queue at a time! Don't re-enqueue it until it's started
+	playing.
+	Returns rSUCCESS, or rBADARG for a bad channel or NULL chunk.
+ */
+int EnqueueChunk(int channelid, mix_chunk * chunk);
 /*
 	Pause channel. The other way of getting n seconds of silence.
  */
@@ -223,17 +287,88 @@ int PlayChannel(int channelid);
  */
 uint16_t SetVolume(int channelid, uint8_t volume);
 /*
-	Set channel panning. TODO: not implemented
+	Set channel panning. Returns the old panning, same deal as SetVolume.
+	Panning goes from FULL_LEFT (-127) to FULL_RIGHT (127); -128 gets treated as -127.
+	Panning works by turning down the side it's panned away from; at FULL_CENTER both sides
+	play at the channel volume, so unpanned channels sound exactly as they always did.
+	Only really does anything on stereo S16/F32 devices; anything else gets the average of the
+	two sides. Ignored for channels registered as emitters (see below), since the emitter
+	decides the panning for them.
+ */
 int8_t SetPanning(int channelid, int8_t panning);
+/*
+	Set how long the mixer can sit with nothing playing before it pauses the audio device, in
+	milliseconds. 0 means never. Defaults to DEFAULT_IDLE_TIMEOUT. Returns the old timeout.
+	While idle the mixer doesn't touch any channels regardless; pausing just takes our callback
+	out of the loop entirely. Any of PlayChunk, SetChunk, InterruptChunk or PlayChannel will
+	transparently unpause the device again, so the rest of the program never needs to know this
+	happened.
+	Note this is NOT a power-saving mode. A paused SDL2 device's audio thread still wakes up
+	every period and feeds the backend silence; the only thing skipped is our callback, which
+	is already next to free when idle. Nobody's measured any battery difference. If you need
+	the hardware to actually go quiet, close the device (org_CloseAudio) instead.
+	Don't pause/unpause the device yourself while this is enabled; we'll fight over it.
+	Does nothing in headless mode, since there's no device to pause.
  */
+int SetIdleTimeout(int ms);
 /*
 	Aborts the specified channel. Basically just wipes the chunk field. Also sets playing = false.
-	Returns the chunk that used to be playing.
+	Returns the chunk that used to be playing. Also drops anything queued with EnqueueChunk; see
+	there for what happens to those.
  */
 mix_chunk * StopChannel(int channelid);
 
 
 
+/*
+	Positional audio. Calling SetVolume/SetPanning on a few hundred sound sources every frame
+	adds up, since each call takes a channel lock. Emitters do the same job in bulk: register
+	the channel once, then once per frame hand over everyone's positions, and the mixer works
+	out attenuation and panning for all of them in one batch and hands the lot to the callback
+	in one go. No channel locks involved.
+	The emitter gains are applied on top of the channel volume, so SetVolume still works as a
+	master volume for the channel.
+
+	None of these are thread-safe with respect to each other; call them all from one thread
+	(presumably the game loop). They're safe with respect to everything else, though.
+
+	Note that an emitter IS a channel: emitters are indexed by channel ID, so there are at most
+	NUM_CHANNELS (16) of them. "Hundreds of sound sources" means hundreds of things in the game
+	world, not hundreds of emitters at once; the game is expected to pick the ones worth hearing
+	(nearest, loudest, whatever) and put those on channels. Raising NUM_CHANNELS raises the cap.
+ */
+typedef struct {
+	float x, y;
+} mix_vec2;
+/*
+	Make channelid an emitter. Inside refDistance of the listener it plays at full volume;
+	from there it fades out linearly, reaching silence at maxDistance. Distances are in
+	whatever units your positions are in.
+	Takes effect immediately: until the next UpdateEmitters it plays centered, at full volume,
+	and the channel's own panning is ignored from here on.
+	Returns rBADARG on a bad channel, refDistance <= 0, or maxDistance <= refDistance;
+	rSUCCESS otherwise. Re-registering updates the distances, and resets it to centered/full
+	volume until the next UpdateEmitters.
+ */
+int RegisterEmitter(int channelid, float refDistance, float maxDistance);
+/*
+	Make channelid a regular channel again. Takes effect immediately.
+ */
+int UnregisterEmitter(int channelid);
+/*
+	Update every emitter at once. positions[i] is the position of the emitter on channel i, so
+	it's indexed by channel ID; entries for channels that aren't emitters are ignored. count is
+	how many entries there are; anything past NUM_CHANNELS is ignored, and emitters past count
+	keep their previous gains.
+	Call this once per frame (or however often things move).
+	The attenuation/panning maths is one loop over the lot, written to be vectorized by the
+	compiler; build with -fno-math-errno (or -ffast-math) to let it, since otherwise sqrtf has
+	to stay a function call for errno's sake.
+ */
+void UpdateEmitters(mix_vec2 listener, const mix_vec2 * positions, int count);
+
+
+
 
 // Clean up and go home
 void org_CloseAudio();
@@ -244,6 +379,7 @@ void org_CloseAudio();
  */
 int GetDeviceID();
 int CheckInitialized();
+int CheckSuspended(); // 1 if the device has been paused for idling
 
 // This one's an interesting case. I don't want to allow direct access to the channel structs, so
 // instead this function will memcpy the channel details into the destination struct. The audiospec
@@ -256,5 +392,40 @@ void GetMixerSpec(SDL_AudioSpec * dest);
 int GetNumStackedChunks(int channel);
 mix_chunk * GetTopChunk(int channel); // returns a pointer to the top chunk on the stack; NO pop
 
+/*
+	Timing stats. Only compiled in with ORG_MIXER_STATS defined, since it means a couple of
+	performance counter reads per callback.
+	Two things get measured:
+	- latency: from a PlayChunk call to the point where the callback that first mixes that chunk
+	  has got its channel locks and starts mixing.
+	  This is the control-to-output delay the mixer is responsible for; mostly it's waiting for
+	  the next callback, so expect it to track chunksize. It does NOT include however long the
+	  OS/driver holds onto the buffer after that (roughly one more chunksize, usually).
+	  StopChannel before the chunk gets mixed means no sample.
+	- callback: how long each MixCallback takes, start to finish. Includes waiting on channel
+	  locks, so this is the number to watch when other threads are hammering SetVolume and
+	  friends.
+	Percentiles come out of a histogram, so they're rounded up to the next bucket boundary
+	(within about 20%); max is exact. All times in microseconds.
+
+	bench/org_mixer_latency.c is a ready-made benchmark built on these: it runs the mixer on
+	SDL's dummy audio driver (no sound hardware needed), hammers the channel functions from a
+	varying number of threads, and prints percentiles for a range of chunksizes.
+ */
+#ifdef ORG_MIXER_STATS
+typedef struct {
+	uint32_t count; // number of samples
+	uint32_t p50;
+	uint32_t p99;
+	uint32_t max;
+} mix_timing;
+typedef struct {
+	mix_timing latency;
+	mix_timing callback;
+} mix_stats;
+void GetMixerStats(mix_stats * dest);
+void ResetMixerStats(void);
+#endif
+
 #endif
 
@@ -0,0 +1,340 @@
+/*
+	Golden-output regression tests for org_mixer.
+
+	Every scenario below drives a headless mixer (org_OpenAudioHeadless) through a fixed script
+	of calls, rendering fixed-size blocks with org_RenderAudio, and compares the result to a
+	checked-in render in golden/<scenario>.txt. Since there's no device involved, the same
+	script always renders the same samples; if one of these changes, either the mixer broke or
+	its behaviour changed on purpose, and in the latter case you regenerate the goldens and
+	eyeball the diff. (That's why they're text: one sample frame per line, left then right.)
+
+	Build, from this directory (the mixer needs the common/ modules from the main tree):
+		cc -std=gnu99 -I.. org_mixer_golden.c ../org_mixer.c ../../common/logging.c \
+			$(sdl2-config --cflags --libs) -lm -lpthread -o org_mixer_golden
+	Run:
+		./org_mixer_golden [golden dir]        (defaults to ./golden)
+		./org_mixer_golden --update [golden dir]
+	Returns 0 if everything matched, 1 otherwise.
+
+	Samples are allowed to be off by TOLERANCE, so that an SDL version with slightly different
+	rounding in SDL_MixAudioFormat doesn't count as a regression. Anything bigger does.
+ */
+
+#include "../org_mixer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#define FREQUENCY 44100
+#define BLOCK_FRAMES 8 // chunksize; small, so chunk boundaries land mid-block
+#define BLOCK_BYTES (BLOCK_FRAMES * 2 * sizeof(int16_t)) // S16, stereo
+#define MAX_BLOCKS 16
+#define TOLERANCE 1
+
+// Everything rendered by the current scenario, end to end
+static int16_t output[MAX_BLOCKS * BLOCK_FRAMES * 2];
+static int outFrames;
+
+// Chunks made by the current scenario, freed at the end of it
+#define MAX_CHUNKS 8
+#define MAX_CHUNK_FRAMES 32
+static int16_t chunkBufs[MAX_CHUNKS][MAX_CHUNK_FRAMES * 2];
+static mix_chunk * chunks[MAX_CHUNKS];
+static int numChunks;
+
+
+/***********
+ * Helpers *
+ ***********/
+
+// Make a chunk of frames sample frames. Left ramps up from base, right ramps down from -base,
+// so every chunk (and every position in it) is recognizable in the output.
+static mix_chunk * MakeChunk(int frames, int base) {
+	int16_t * buf = chunkBufs[numChunks];
+	int f;
+	for (f = 0; f < frames; f++) {
+		buf[2*f] = base + f * 10;
+		buf[2*f + 1] = -(base + f * 10);
+	}
+
+	mix_chunk * chunk = allocate_chunk();
+	chunk->buf = (char *)buf;
+	chunk->buflen = frames * 2 * sizeof(int16_t);
+	chunks[numChunks++] = chunk;
+	return chunk;
+}
+
+static void Render(int blocks) {
+	int b;
+	for (b = 0; b < blocks; b++) {
+		org_RenderAudio((uint8_t *)(output + outFrames * 2), BLOCK_BYTES);
+		outFrames += BLOCK_FRAMES;
+	}
+}
+
+#define FRAMES(n) ((n) * 2 * (int)sizeof(int16_t)) // frames => bytes, for loop points
+
+
+/*************
+ * Scenarios *
+ *************/
+
+// A plain chain: A -> B -> C through nextChunk, none of them block-aligned.
+static void Chain(void) {
+	mix_chunk * a = MakeChunk(5, 1000);
+	mix_chunk * b = MakeChunk(3, 2000);
+	mix_chunk * c = MakeChunk(7, 3000);
+	a->nextChunk = b;
+	b->nextChunk = c;
+
+	PlayChunk(0, a);
+	Render(3);
+}
+
+// The callback gets first say: the chunk it returns plays instead of nextChunk.
+// A's callback returns C the first time and NULL after, and C chains back to A, so this
+// should come out as A, C, A, B.
+static mix_chunk * callbackChunk;
+static void * ReturnOnce(int channel, void * chunk) {
+	mix_chunk * ret = callbackChunk;
+	callbackChunk = NULL;
+	return ret;
+}
+static void CallbackReturn(void) {
+	mix_chunk * a = MakeChunk(4, 1000);
+	mix_chunk * b = MakeChunk(4, 2000);
+	mix_chunk * c = MakeChunk(6, 3000);
+	a->callback = ReturnOnce;
+	a->nextChunk = b;
+	c->nextChunk = a;
+	callbackChunk = c;
+
+	PlayChunk(0, a);
+	Render(3);
+}
+
+// Interrupts, two deep. A gets interrupted partway through by B, which gets interrupted before
+// it even starts by C. Should come out as the start of A, then C, B, and the rest of A.
+static void Interrupt(void) {
+	mix_chunk * a = MakeChunk(12, 1000);
+	mix_chunk * b = MakeChunk(5, 2000);
+	mix_chunk * c = MakeChunk(3, 3000);
+
+	PlayChunk(0, a);
+	Render(1);
+	InterruptChunk(0, b);
+	InterruptChunk(0, c);
+	Render(3);
+}
+
+// The old way of looping: nextChunk pointing at itself. Wraps mid-block every time.
+static void SelfLoop(void) {
+	mix_chunk * a = MakeChunk(6, 1000);
+	a->nextChunk = a;
+
+	PlayChunk(0, a);
+	Render(3);
+}
+
+// The new way: loop points. Frames 4-8 play three times in total, then the tail.
+static void LoopPoints(void) {
+	mix_chunk * a = MakeChunk(12, 1000);
+	a->loopstart = FRAMES(4);
+	a->loopend = FRAMES(8);
+	a->loops = 2;
+
+	PlayChunk(0, a);
+	Render(3);
+}
+
+// EnqueueChunk: queued chunks play in order after the current chain.
+static void Queue(void) {
+	mix_chunk * a = MakeChunk(5, 1000);
+	mix_chunk * b = MakeChunk(3, 2000);
+	mix_chunk * c = MakeChunk(9, 3000);
+	mix_chunk * d = MakeChunk(2, 4000);
+	a->nextChunk = b;
+
+	PlayChunk(0, a);
+	EnqueueChunk(0, c);
+	EnqueueChunk(0, d);
+	Render(3);
+}
+
+// Two channels at once, one at half volume, plus one loud enough to clip.
+static void MixVolume(void) {
+	mix_chunk * a = MakeChunk(16, 1000);
+	mix_chunk * b = MakeChunk(16, 2000);
+	mix_chunk * c = MakeChunk(8, 31000);
+
+	SetVolume(1, MAX_VOL / 2);
+	PlayChunk(0, a);
+	PlayChunk(1, b);
+	Render(1);
+	PlayChunk(2, c);
+	Render(2);
+}
+
+// SetPanning, both directions.
+static void Panning(void) {
+	mix_chunk * a = MakeChunk(16, 1000);
+	mix_chunk * b = MakeChunk(16, 2000);
+
+	SetPanning(0, FULL_RIGHT / 2);
+	SetPanning(1, FULL_LEFT);
+	PlayChunk(0, a);
+	PlayChunk(1, b);
+	Render(2);
+}
+
+// Emitters. Channel 0 is off to the left at half attenuation; channel 1 is at (3, 4), i.e.
+// 5 away, 0.6 gain, panned 0.6 right. Then channel 0 stops being an emitter.
+static void Emitters(void) {
+	mix_chunk * a = MakeChunk(24, 1000);
+	mix_chunk * b = MakeChunk(24, 2000);
+	mix_vec2 listener = { 0, 0 };
+	mix_vec2 positions[2] = { { -6, 0 }, { 3, 4 } };
+
+	RegisterEmitter(0, 1, 11);
+	RegisterEmitter(1, 1, 11);
+	UpdateEmitters(listener, positions, 2);
+	PlayChunk(0, a);
+	PlayChunk(1, b);
+	Render(2);
+	UnregisterEmitter(0);
+	Render(1);
+}
+
+// Nothing playing (the idle fast path), then something.
+static void Idle(void) {
+	mix_chunk * a = MakeChunk(10, 1000);
+
+	Render(1);
+	PlayChunk(0, a);
+	Render(2);
+}
+
+typedef struct {
+	const char * name;
+	void (*run)(void);
+} scenario;
+
+static const scenario scenarios[] = {
+	{ "chain", Chain },
+	{ "callback_return", CallbackReturn },
+	{ "interrupt", Interrupt },
+	{ "self_loop", SelfLoop },
+	{ "loop_points", LoopPoints },
+	{ "queue", Queue },
+	{ "mix_volume", MixVolume },
+	{ "panning", Panning },
+	{ "emitters", Emitters },
+	{ "idle", Idle },
+};
+#define NUM_SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+
+/*********************
+ * Golden file stuff *
+ *********************/
+
+static int WriteGolden(const char * path) {
+	FILE * f = fopen(path, "w");
+	if (f == NULL) {
+		return 1;
+	}
+	int i;
+	for (i = 0; i < outFrames; i++) {
+		fprintf(f, "%d %d\n", output[2*i], output[2*i + 1]);
+	}
+	fclose(f);
+	return 0;
+}
+
+// Returns 0 if the output matches the golden file
+static int CompareGolden(const char * name, const char * path) {
+	FILE * f = fopen(path, "r");
+	if (f == NULL) {
+		printf("FAIL %s: can't open %s\n", name, path);
+		return 1;
+	}
+
+	int frame = 0, left, right, failed = 0;
+	while (fscanf(f, "%d %d", &left, &right) == 2) {
+		if (frame >= outFrames) {
+			frame++; // keep counting, for the message below
+			continue;
+		}
+		if (abs(left - output[2*frame]) > TOLERANCE || abs(right - output[2*frame + 1]) > TOLERANCE) {
+			printf("FAIL %s: frame %d: got %d %d, expected %d %d\n", name, frame,
+				output[2*frame], output[2*frame + 1], left, right);
+			failed = 1;
+			break;
+		}
+		frame++;
+	}
+	fclose(f);
+
+	if (!failed && frame != outFrames) {
+		printf("FAIL %s: rendered %d frames, golden has %d\n", name, outFrames, frame);
+		failed = 1;
+	}
+	return failed;
+}
+
+
+int main(int argc, char ** argv) {
+	int update = 0;
+	const char * dir = "golden";
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--update") == 0) {
+			update = 1;
+		} else {
+			dir = argv[i];
+		}
+	}
+
+	int failures = 0;
+	for (i = 0; i < NUM_SCENARIOS; i++) {
+		// Fresh mixer every time, so scenarios can't leak state into each other
+		if (org_OpenAudioHeadless(FREQUENCY, AUDIO_S16SYS, 2, BLOCK_FRAMES) != 0) {
+			printf("FAIL %s: couldn't open headless mixer\n", scenarios[i].name);
+			return 1;
+		}
+		memset(output, 0, sizeof(output));
+		outFrames = 0;
+		numChunks = 0;
+
+		scenarios[i].run();
+
+		org_CloseAudio();
+		while (numChunks > 0) {
+			free(chunks[--numChunks]);
+		}
+
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s.txt", dir, scenarios[i].name);
+		if (update) {
+			if (WriteGolden(path)) {
+				printf("FAIL %s: can't write %s\n", scenarios[i].name, path);
+				failures++;
+			} else {
+				printf("wrote %s\n", path);
+			}
+		} else if (CompareGolden(scenarios[i].name, path)) {
+			failures++;
+		} else {
+			printf("ok   %s\n", scenarios[i].name);
+		}
+	}
+
+	if (failures) {
+		printf("%d of %d scenarios failed\n", failures, NUM_SCENARIOS);
+	}
+	return failures ? 1 : 0;
+}